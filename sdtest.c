@@ -31,6 +31,10 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/resource.h>
 
 //-----------------------------------------------------------------------------
 // Constant & Type Definitions
@@ -39,6 +43,14 @@
 #define LOG sdlog
 #define DEFAULT_BUFFER_MODULO (1024*1024)
 #define DEFAULT_BUFFER_SIZE   (DEFAULT_BUFFER_MODULO*128)
+#define DEGRADE_ALPHA         0.0625   // EWMA weight of each new block timing
+#define DEGRADE_REGIONS       1024     // max reference regions per shard
+#define DEGRADE_NOISE_USECS   5000.0   // added to timings so scheduling jitter doesn't count
+#define DEGRADE_OUTLIER_FACTOR 1.5     // slow block if this many times its reference
+#define DEGRADE_STALL_FACTOR  3.0      // stall if this many times its reference
+#define DEGRADE_CUSUM_K       0.1      // CUSUM slack, log ratio (~10% slower)
+#define DEGRADE_CUSUM_H       2.0      // CUSUM change-point threshold, log ratio
+#define DEGRADE_TRIPS         3        // stalls+changes in a pass before marking or stopping
 #define HERE printf("%s:%d\n",__FILE__,__LINE__);fflush(stdout);
 
 typedef struct device_info_s
@@ -60,6 +72,35 @@ typedef enum
    MAX
 } test_type_e;
 
+typedef enum
+{
+   DEGRADE_NONE = 0,
+   DEGRADE_LOG,                           // log alerts only
+   DEGRADE_MARK,                          // log and mark degraded in stats
+   DEGRADE_STOP                           // mark and stop the run early
+} degrade_policy_e;
+
+typedef struct health_s
+{
+   double   mean;                         // EWMA of block usecs
+   double   var;                          // EWMA variance of block usecs
+   double   shift;                        // EWMA of log(usecs / reference)
+   double   cusum;                        // one-sided CUSUM of log(usecs / reference)
+   float    *ref;                         // per region reference usecs, phase 1 then 2
+   float    *sum;                         // per region sums while learning the reference
+   uint32_t *count;
+   unsigned int first;                    // shard the regions map onto
+   unsigned int blocks;
+   unsigned int regions;
+   int      learned;                      // flag once a full pass of reference is in
+   uint64_t samples;
+   uint64_t trips;                        // stalls+changes this pass
+   uint64_t pass_changes;                 // changes this pass
+   uint64_t outliers;
+   uint64_t stalls;
+   uint64_t changes;
+} health_t;
+
 typedef struct bwt_s
 {
    struct timeval start_tv;
@@ -68,6 +109,8 @@ typedef struct bwt_s
    uint64_t result_usecs;
 } bwt_t;
 
+struct worker_s;
+
 typedef struct globals_s
 {
    device_info_t     di;                  // struct to hold device information
@@ -82,16 +125,51 @@ typedef struct globals_s
    int               logstdout;           // flag to log to stdout as well as file
    unsigned int      block_size;          // read/write blocks, same as buffer unless tiny partition
    unsigned int      block_writes;        // number of block_size in the device
+   unsigned int      tail_size;           // aligned remainder tested as a last, smaller block
+   unsigned int      blocks;              // block_writes plus the tail block, if any
    unsigned int      buffer_size;         // override for default block_size
+   unsigned int      io_size;             // sub-I/O size, same as block unless memory budgeted
+   uint64_t          mem_budget;          // bytes allowed for all test buffers, 0 for no limit
    unsigned int      bandwidth_avg;
    uint64_t          pass_count;
    uint64_t          written_total;
    int               quitpasses;          // count to quit after N passes
-   bwt_t             buffer_bw;           // timers and counts for buffer bandwidth
+   degrade_policy_e  degrade_policy;      // what to do when the card degrades
+   int               degraded;            // flag set once degradation is seen
+   volatile int      halt;                // flag to stop the run early
+   unsigned int      workers;             // number of shards/threads per pass
+   int               scaling;             // flag to ramp up workers 1..N first
+   struct worker_s   *worker;             // per-shard worker state
+   unsigned int      active;              // workers used by the last pass
+   uint64_t          pass_wrbps;          // last pass write bandwidth, all workers
+   uint64_t          pass_rdbps;          // last pass read bandwidth, all workers
+   uint64_t          pass_iobps;          // last pass wall clock I/O bandwidth
+   bwt_t             pass_bw;             // timer for the whole pass
    FILE              *logfd;
    unsigned char     *randbuf;
 } globals_t;
 
+typedef struct worker_s
+{
+   globals_t         *g;                  // back pointer to globals
+   unsigned int      id;                  // shard number
+   int               fd;                  // this worker's device handle
+   pthread_t         thread;
+   unsigned int      first;               // first block of the shard
+   unsigned int      last;                // one past the last block of the shard
+   unsigned int      rand_offset;         // position in the rand pattern stream
+   unsigned char     *rbuf;
+   unsigned char     *wbuf;
+   bwt_t             buffer_bw;           // timers and counts for buffer bandwidth
+   health_t          wr_health;           // online write timing stats
+   health_t          rd_health;           // online read timing stats
+   uint64_t          wr_bytes;            // pass totals for this worker
+   uint64_t          wr_usecs;
+   uint64_t          rd_bytes;
+   uint64_t          rd_usecs;
+   int               rc;
+} worker_t;
+
 //-----------------------------------------------------------------------------
 // Variable Declarations
 //-----------------------------------------------------------------------------
@@ -106,6 +184,11 @@ static int device_setup(globals_t *g);
 static int device_test(globals_t *g);
 static char *gettime();
 static uint64_t measurebw(int start, uint64_t bytes, bwt_t *bwt);
+static void health_update(globals_t *g, health_t *h, const char *op,
+                          unsigned int index, uint64_t usecs);
+static void health_log(globals_t *g);
+static void health_setup(health_t *h, unsigned int first, unsigned int blocks);
+static void health_pass(health_t *h);
 static void stats_log_setup(globals_t *g);
 static void mklogname(globals_t *g);
 static void check_device_name(globals_t *g);
@@ -146,7 +229,13 @@ static void stats_log_setup(globals_t *g)
    LOG("starttime=%s\n", gettime());
    LOG("block_size=%u\n", g->block_size);
    LOG("block_writes=%u\n", g->block_writes);
+   if (g->tail_size)
+      LOG("tail_size=%u\n", g->tail_size);
    LOG("buffer_size=%u\n", g->buffer_size);
+   if (g->workers > 1)
+      LOG("workers=%u\n", g->workers);
+   if (g->mem_budget)
+      LOG("mem_budget=%lu:io_size=%u\n", g->mem_budget, g->io_size);
    if (g->message)
       LOG("message=%s\n",g->message);
 
@@ -158,15 +247,21 @@ static void stats_log_setup(globals_t *g)
  */
 static void get_previous_counts(globals_t *g)
 {
-   char str[200];
+   char line[256];
+   char str[256] = "";
    char *token, *s1, *endptr;
 
-   while(fgets(str, 200, g->logfd));
-   if (!strstr(str, "stats"))
+   // alerts and health lines land mid-pass, keep the last stats line
+   while(fgets(line, sizeof(line), g->logfd))
+      if (strstr(line, "] stats:"))
+         strcpy(str, line);
+   if (!str[0])
    {
       fprintf(stderr, "WARNING: log file doesn't have any data, starting from 0\n");
       return;
    }
+   if (strstr(str, ":degraded"))
+      g->degraded = 1;
    token= strtok_r(str, ":", &s1);
    token= strtok_r(s1, ":", &s1);
    g->written_total = strtoul(token,&endptr,0);
@@ -216,6 +311,15 @@ static void usage(char *cmd)
    printf("  -t <test type>   where 'z' is zeroes/ones, 'r' is random with CRCs\n");
    printf("  -b <buffer size> override default buffer size of 134217728 (modulo 1048576) \n");
    printf("  -q <passes>      quit after number of passes\n");
+   printf("  -M <bytes>       memory budget for test buffers, streams each block as\n");
+   printf("                   smaller aligned I/Os checked as they come back\n");
+   printf("  -w <workers>     split the device into N shards tested in parallel,\n");
+   printf("                   each worker allocates two buffers\n");
+   printf("  -s               ramp up from 1 to N workers, one pass each, and log\n");
+   printf("                   the throughput scaling\n");
+   printf("  -d <policy>      watch block timings for degradation, where 'l' logs\n");
+   printf("                   alerts, 'm' also marks the card degraded in the stats\n");
+   printf("                   and 's' also stops the run early\n");
    printf("  device           such as /dev/sdb or a partition /dev/sdb1\n");
 }
 
@@ -230,13 +334,14 @@ static void parse_cmdline(globals_t *g, int argc, char **argv)
 {
    int c;
    char *endptr;
+   long workers = 1;
 
    if (argc < 3) {
       usage(argv[0]); exit(-1);
    }
 
    // parse the command options
-   while ((c = getopt(argc, argv, "hivTZOm:t:b:q:")) != -1)
+   while ((c = getopt(argc, argv, "hivTZOsm:t:b:q:d:w:M:")) != -1)
       switch (c) {
          case 't': g->test_type = (optarg[0] == 'z') ? ZERO : \
                                   (optarg[0] == 'r') ? RAND : 0; break;
@@ -247,7 +352,14 @@ static void parse_cmdline(globals_t *g, int argc, char **argv)
          case 'O': g->logstdout++;                               break;
          case 'b': g->buffer_size = strtoul(optarg,&endptr,0);   break;
          case 'q': g->quitpasses = strtoul(optarg,&endptr,0);    break;
+         case 'w': workers = strtol(optarg,&endptr,0);           break;
+         case 's': g->scaling++;                                 break;
+         case 'M': g->mem_budget = strtoull(optarg,&endptr,0);   break;
          case 'm': g->message = strdup(optarg);                  break;
+         case 'd': g->degrade_policy = (optarg[0] == 'l') ? DEGRADE_LOG : \
+                                       (optarg[0] == 'm') ? DEGRADE_MARK : \
+                                       (optarg[0] == 's') ? DEGRADE_STOP : \
+                                       DEGRADE_NONE;             break;
          case '?':
          case 'h':
          usage(argv[0]);
@@ -262,6 +374,21 @@ static void parse_cmdline(globals_t *g, int argc, char **argv)
    }
    g->devicename = strdup(argv[optind]);
 
+   if (workers < 1)
+   {
+      fprintf(stderr, "ERROR: 'workers' must be 1 or more\n");
+      usage(argv[0]);
+      exit(-1);
+   }
+   g->workers = (unsigned int)workers;
+
+   if (g->scaling && g->quitpasses && g->quitpasses < g->workers)
+   {
+      fprintf(stderr, "ERROR: 'passes' must cover the scaling ramp of %u workers\n", g->workers);
+      usage(argv[0]);
+      exit(-1);
+   }
+
    if (g->buffer_size %  DEFAULT_BUFFER_MODULO)
    {
       fprintf(stderr, "ERROR: 'buffer size' must be modulo 1048576\n");
@@ -272,7 +399,7 @@ static void parse_cmdline(globals_t *g, int argc, char **argv)
 
 /* /dev/urandom will only return 0x1fffff bytes, I'll assume this is */
 /* the prbs wrapping around. Rather than using /dev/urandom directly */
-/* I'll make a rand buffer 2xblock_size and increment the pointer    */
+/* I'll make a rand buffer 2xio_size and increment the pointer       */
 /* each write to change data, unfortunately, to use direct IO, we    */
 /* have to copy from the rand buf into the aligned wbuf each time    */
 static unsigned char *create_randbuf(globals_t *g, int bufsize)
@@ -355,8 +482,38 @@ static int device_setup(globals_t *g)
       g->block_size = g->buffer_size;
       g->block_writes = (unsigned int)(g->di.size / g->buffer_size);
    }
+
+   // cover the rest of the device with a smaller block, kept sector
+   // aligned for direct I/O
+   g->tail_size = (unsigned int)(g->di.size - (uint64_t)g->block_writes * g->block_size);
+   if (g->di.sector_size_logical)
+      g->tail_size -= g->tail_size % g->di.sector_size_logical;
+   g->blocks = g->block_writes + (g->tail_size ? 1 : 0);
+
+   // every shard needs at least one block
+   if (g->workers > g->blocks)
+      g->workers = g->blocks;
+
+   // with a memory budget, blocks are streamed as sub-I/Os sized so
+   // every worker's rbuf+wbuf and the shared 2x randbuf fit the budget
+   g->io_size = g->block_size;
+   if (g->mem_budget)
+   {
+      size_t align = g->di.sector_size_logical ? g->di.sector_size_logical : 512;
+      uint64_t io_size = g->mem_budget / (2 * g->workers + (g->test_type == RAND ? 2 : 0));
+
+      io_size -= io_size % align;
+      if (!io_size)
+      {
+         fprintf(stderr, "ERROR: memory budget %lu too small for %u worker(s)\n",
+            g->mem_budget, g->workers);
+         exit(-1);
+      }
+      if (io_size < g->io_size)
+         g->io_size = (unsigned int)io_size;
+   }
    if (g->test_type == RAND)
-      g->randbuf = create_randbuf(g, g->block_size * 2);
+      g->randbuf = create_randbuf(g, g->io_size * 2);
 
    return 0;
 }
@@ -375,16 +532,321 @@ static void dump_buffer( unsigned char * pBuf, int iLen )
 }
 #endif
 /*!
- * @brief Write Rand
+ * @brief Pattern - data for one sub-I/O of a block
+ *
+ * RAND points straight into randbuf, each sub-I/O of a block shifted
+ * one byte along from the last so no two match. ZERO fills buf.
+ *
+ * @param w             pointer to worker
+ * @param chunk         sub-I/O number within the block
+ * @param buf           buffer to fill for ZERO
+ * @param len           sub-I/O length
+ * @param ones          flag for the ones (first) half of the test
+ */
+static unsigned char *pattern(worker_t *w, unsigned int chunk,
+                              unsigned char *buf, unsigned int len, int ones)
+{
+   globals_t *g = w->g;
+
+   if (g->test_type == ZERO)
+   {
+      memset(buf, ones ? 0xFF : 0, len);
+      return buf;
+   }
+   return g->randbuf + (w->rand_offset + chunk) % (g->io_size + 1);
+}
+
+/*!
+ * @brief Next Rand - move the rand pattern stream on for the next write
+ *
+ */
+static void next_rand(worker_t *w)
+{
+   w->rand_offset++;
+   if (w->rand_offset > w->g->io_size)
+      w->rand_offset = 0;
+}
+
+/*!
+ * @brief Account one buffer I/O of a worker to its pass and health stats
+ *
+ * @param w             pointer to worker
+ * @param op            operation tag, "W1", "R1", "W2" or "R2"
+ * @param index         block index
+ * @param bps           bandwidth returned by measurebw()
+ * @param write         flag for a write, else a read
+ */
+static void worker_account(worker_t *w, const char *op, unsigned int index,
+                           uint64_t bps, int write)
+{
+   globals_t *g = w->g;
+
+   if (write)
+   {
+      w->wr_bytes += w->buffer_bw.result_bytes;
+      w->wr_usecs += w->buffer_bw.result_usecs;
+      __sync_fetch_and_add(&g->written_total, w->buffer_bw.result_bytes);
+   }
+   else
+   {
+      w->rd_bytes += w->buffer_bw.result_bytes;
+      w->rd_usecs += w->buffer_bw.result_usecs;
+   }
+
+   if (g->degrade_policy)
+      health_update(g, write ? &w->wr_health : &w->rd_health, op, index,
+                    w->buffer_bw.result_usecs);
+
+   // one LOG call per line so workers don't interleave
+   if(g->verbose)
+      LOG("stats:%lu:%lu:wrbw=%u.%02u MB/s:rdbw=%u.%02u MB/s:buffer stats:%s:%lu:%lu:%u.%02u MB/s%s\n",
+         g->written_total,
+         g->pass_count,
+         (unsigned int)g->pass_wrbps/1000000,
+         (unsigned int)g->pass_wrbps%1000000,
+         (unsigned int)g->pass_rdbps/1000000,
+         (unsigned int)g->pass_rdbps%1000000,
+         op,
+         w->buffer_bw.result_bytes,
+         w->buffer_bw.result_usecs,
+         (unsigned int)(bps/1000000),
+         (unsigned int)(bps%1000000),
+         g->degraded ? ":degraded" : "");
+}
+
+/*!
+ * @brief Worker Mismatch - report a failed compare and stop the run
  *
+ * @param w             pointer to worker
+ * @param index         block index
+ * @param pos           byte offset of the sub-I/O within the block
+ * @param expected      expected data
+ * @param len           length of the compared sub-I/O
+ * @param dump          flag to dump the buffers to files "wbuf" and "rbuf"
  */
-static void write_rand(globals_t *g, unsigned char *buf, unsigned int size)
+static int worker_mismatch(worker_t *w, unsigned int index, unsigned int pos,
+                           unsigned char *expected, unsigned int len, int dump)
 {
-   static unsigned int offset = 0;
-   memcpy(buf, g->randbuf+offset, size);
-   offset++;
-   if (offset > size)
-      offset = 0;
+   globals_t *g = w->g;
+   FILE *fd;
+
+   if (dump)
+   {
+      fd = fopen("wbuf","w+");
+      fwrite(expected,1,len,fd);
+      fclose(fd);
+      fd = fopen("rbuf","w+");
+      fwrite(w->rbuf,1,len,fd);
+      fclose(fd);
+   }
+
+   // streamed blocks only dump the failing sub-I/O, say where it was
+   if (g->io_size < g->block_size)
+      LOG("error at block %u, bytes %u-%u (device offset %lu), exiting...\n",
+         index, pos, pos + len - 1, (uint64_t)index * g->block_size + pos);
+   else
+      LOG("error at block %u, exiting...\n", index);
+   w->rc = -1;
+   g->halt = 1;
+   return -1;
+}
+
+/*!
+ * @brief Positional I/O of a whole buffer, retrying short transfers and EINTR
+ *
+ * @param fd            device handle
+ * @param buf           buffer
+ * @param len           bytes to transfer
+ * @param off           64-bit device offset
+ * @param write         flag for a write, else a read
+ * @return              bytes transferred, less than len on error or end of device
+ */
+static size_t pio(int fd, unsigned char *buf, size_t len, off_t off, int write)
+{
+   size_t done = 0;
+   ssize_t n;
+
+   while (done < len)
+   {
+      if (write)
+         n = pwrite(fd, buf+done, len-done, off+done);
+      else
+         n = pread(fd, buf+done, len-done, off+done);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         break;
+      done += n;
+   }
+   return done;
+}
+
+/*!
+ * @brief Worker I/O - write or read back one block as a stream of sub-I/Os
+ *
+ * Without a memory budget io_size is the block size and this is one
+ * I/O, checked against wbuf. With one, each sub-I/O is generated or
+ * checked as it goes, so no buffer ever holds the whole block. Only the
+ * I/O time is accounted, not pattern generation or compares.
+ *
+ * @param w             pointer to worker
+ * @param op            operation tag, "W1", "R1", "W2" or "R2"
+ * @param index         block index
+ * @param len           block length
+ * @param write         flag for a write from wbuf, else a read into rbuf
+ * @param ones          flag for the ones (first) half of the test
+ */
+static int worker_io(worker_t *w, const char *op, unsigned int index,
+                     unsigned int len, int write, int ones)
+{
+   globals_t *g = w->g;
+   off_t off = (off_t)index * g->block_size;
+   unsigned char *src;
+   unsigned int chunk;
+   unsigned int pos;
+   unsigned int n;
+   uint64_t usecs = 0;
+   uint64_t bps;
+   size_t done;
+
+   for (chunk = 0, pos = 0; pos < len; chunk++, pos += n)
+   {
+      n = (len - pos < g->io_size) ? len - pos : g->io_size;
+
+      // direct I/O needs the aligned wbuf, so copy the pattern in
+      if (write)
+      {
+         src = pattern(w, chunk, w->wbuf, n, ones);
+         if (src != w->wbuf)
+            memcpy(w->wbuf, src, n);
+      }
+
+      errno = 0;
+      measurebw(1, 0, &w->buffer_bw);
+      done = pio(w->fd, write ? w->wbuf : w->rbuf, n, off+pos, write);
+      measurebw(0, n, &w->buffer_bw);
+      usecs += w->buffer_bw.result_usecs;
+      if (done != n)
+      {
+         LOG("%s error at block %u, %lu of %u bytes: %s, exiting...\n",
+            op, index, (uint64_t)(pos+done), len,
+            errno ? strerror(errno) : "short I/O");
+         w->rc = -1;
+         g->halt = 1;
+         return -1;
+      }
+
+      // a single I/O block still has its pattern in wbuf
+      if (!write)
+      {
+         src = (n == len) ? w->wbuf : pattern(w, chunk, w->wbuf, n, ones);
+         if (memcmp(w->rbuf, src, n))
+            return worker_mismatch(w, index, pos, src, n, ones);
+      }
+   }
+
+   w->buffer_bw.result_bytes = len;
+   w->buffer_bw.result_usecs = usecs;
+   bps = usecs ? (uint64_t)len * 1000000 / usecs : 0;
+   worker_account(w, op, index, bps, write);
+   return 0;
+}
+
+/*!
+ * @brief Worker - test each block of this worker's shard once
+ *
+ * @param arg           pointer to worker
+ */
+static void *worker_run(void *arg)
+{
+   worker_t *w = (worker_t *)arg;
+   globals_t *g = w->g;
+   unsigned int index;
+   unsigned int len;
+
+   // within each shard are blocks, where each block is tested
+   for (index = w->first; index < w->last && !g->halt; index++)
+   {
+      // the tail block past block_writes is smaller
+      len = (index < g->block_writes) ? g->block_size : g->tail_size;
+
+      // write ones or rand, read back and check:
+      if (worker_io(w, "W1", index, len, 1, 1) ||
+          worker_io(w, "R1", index, len, 0, 1))
+         break;
+      next_rand(w);
+
+      // write zeroes or rand, read back and check:
+      if (worker_io(w, "W2", index, len, 1, 0) ||
+          worker_io(w, "R2", index, len, 0, 0))
+         break;
+      next_rand(w);
+   }
+   return NULL;
+}
+
+/*!
+ * @brief Run Pass - one pass over the device, sharded across workers
+ *
+ * Each worker gets a disjoint, contiguous range of blocks. The pass
+ * bandwidth is the sum of each worker's average, the wall clock
+ * bandwidth of all I/O in the pass lands in g->pass_iobps.
+ *
+ * @param g             pointer to globals
+ * @param nworkers      number of workers for this pass
+ */
+static int run_pass(globals_t *g, unsigned int nworkers)
+{
+   worker_t *w;
+   unsigned int i;
+   int rc = 0;
+   uint64_t bytes = 0;
+   uint64_t wrbps = 0;
+   uint64_t rdbps = 0;
+
+   g->active = nworkers;
+   measurebw(1, 0, &g->pass_bw);
+   for (i = 0; i < nworkers; i++)
+   {
+      w = &g->worker[i];
+      w->first = (unsigned int)((uint64_t)g->blocks * i / nworkers);
+      w->last = (unsigned int)((uint64_t)g->blocks * (i + 1) / nworkers);
+      w->wr_bytes = w->wr_usecs = w->rd_bytes = w->rd_usecs = 0;
+      if (g->degrade_policy && (w->wr_health.first != w->first ||
+                                w->wr_health.blocks != w->last - w->first))
+      {
+         health_setup(&w->wr_health, w->first, w->last - w->first);
+         health_setup(&w->rd_health, w->first, w->last - w->first);
+      }
+      if (pthread_create(&w->thread, NULL, worker_run, w))
+      {
+         LOG("could not start worker %u, exiting\n", i);
+         exit(-1);
+      }
+   }
+
+   for (i = 0; i < nworkers; i++)
+   {
+      w = &g->worker[i];
+      pthread_join(w->thread, NULL);
+      if (w->rc)
+         rc = w->rc;
+      bytes += w->wr_bytes + w->rd_bytes;
+      if (g->degrade_policy)
+      {
+         health_pass(&w->wr_health);
+         health_pass(&w->rd_health);
+      }
+      if (w->wr_usecs)
+         wrbps += w->wr_bytes * 1000000 / w->wr_usecs;
+      if (w->rd_usecs)
+         rdbps += w->rd_bytes * 1000000 / w->rd_usecs;
+   }
+   g->pass_iobps = measurebw(0, bytes, &g->pass_bw);
+   g->pass_wrbps = wrbps;
+   g->pass_rdbps = rdbps;
+
+   return rc;
 }
 
 /*!
@@ -393,172 +855,109 @@ static void write_rand(globals_t *g, unsigned char *buf, unsigned int size)
  */
 static int device_test(globals_t *g)
 {
-   int fd;
+   worker_t *w;
+   unsigned int i;
    int rc = 0;
-   unsigned char *rbuf;
-   unsigned char *wbuf;
-   unsigned int index = 0;
-   uint64_t pass_wrbps =  0;
-   uint64_t pass_rdbps = 0;
-   uint64_t buffer_wrbps1;
-   uint64_t buffer_wrbps2;
-   uint64_t buffer_rdbps1;
-   uint64_t buffer_rdbps2;
-
-   fd = open(g->devicename, O_RDWR | __O_DIRECT);
-   if (fd < 0)
+   unsigned int nworkers;
+   int ramp = g->scaling;
+   uint64_t base_iobps = 0;
+   uint64_t speedup;
+   struct rusage ru;
+
+   g->worker = calloc(g->workers, sizeof(worker_t));
+   for (i = 0; i < g->workers; i++)
    {
-      LOG("could not open %s, exiting %d\n", g->devicename, fd);
-      exit(-1);
+      w = &g->worker[i];
+      w->g = g;
+      w->id = i;
+      w->fd = open(g->devicename, O_RDWR | __O_DIRECT);
+      if (w->fd < 0)
+      {
+         LOG("could not open %s, exiting %d\n", g->devicename, w->fd);
+         exit(-1);
+      }
+      w->rbuf = memalign(g->di.sector_size_logical, g->io_size);
+      w->wbuf = memalign(g->di.sector_size_logical, g->io_size);
+      if (!w->rbuf || !w->wbuf)
+      {
+         LOG("could not allocate buffers for worker %u, exiting\n", i);
+         exit(-1);
+      }
+      // stagger each worker's pattern stream
+      w->rand_offset = (unsigned int)((uint64_t)g->io_size * i / g->workers);
    }
 
-   rbuf = memalign(g->di.sector_size_logical, g->block_size);
-   wbuf = memalign(g->di.sector_size_logical, g->block_size);
+   // with scaling, ramp up from 1 worker, one pass each
+   nworkers = ramp ? 1 : g->workers;
 
    while(1)
    {
-      // a 'pass' is defined as the whole device (or partition)
-      lseek(fd, 0, SEEK_SET);
-      index = 0;
-
-      LOG("stats:%lu:%lu:wrbw=%u.%02u MB/s:rdbw=%u.%02u MB/s\n",
+      if (g->degrade_policy)
+         health_log(g);
+      getrusage(RUSAGE_SELF, &ru);
+      LOG("stats:%lu:%lu:wrbw=%u.%02u MB/s:rdbw=%u.%02u MB/s:maxrss=%ld kB%s\n",
          g->written_total,
          g->pass_count,
-         (unsigned int)pass_wrbps/1000000,
-         (unsigned int)pass_wrbps%1000000,
-         (unsigned int)pass_rdbps/1000000,
-         (unsigned int)pass_rdbps%1000000);
+         (unsigned int)g->pass_wrbps/1000000,
+         (unsigned int)g->pass_wrbps%1000000,
+         (unsigned int)g->pass_rdbps/1000000,
+         (unsigned int)g->pass_rdbps%1000000,
+         ru.ru_maxrss,
+         g->degraded ? ":degraded" : "");
+
+      if (g->halt || (g->quitpasses && (g->pass_count >= g->quitpasses)))
+      {
+         // -q counts lifetime passes, so a restart can still land mid-ramp
+         if (ramp)
+            LOG("scaling:cut short after %u of %u workers\n", nworkers - 1, g->workers);
+         goto done;
+      }
 
-      if (g->quitpasses && (g->pass_count >= g->quitpasses))
+      // a 'pass' is defined as the whole device (or partition)
+      rc = run_pass(g, nworkers);
+      if (rc)
          goto done;
 
-      // within each pass are blocks, where each block is tested
-      while(index < g->block_writes)
+      // a pass cut short by a degraded card doesn't count
+      if (g->halt)
+         continue;
+
+      g->pass_count++;
+
+      if (ramp)
       {
-         // write ones or rand:
-         lseek(fd, index*g->block_size, SEEK_SET);
-         if (g->test_type == ZERO)
-            memset(wbuf, 0xFF, g->block_size);
+         if (nworkers == 1)
+            base_iobps = g->pass_iobps;
+         speedup = base_iobps ? g->pass_iobps * 100 / base_iobps : 0;
+         LOG("scaling:%u workers:iobw=%u.%02u MB/s:speedup=%u.%02u\n",
+            nworkers,
+            (unsigned int)(g->pass_iobps/1000000),
+            (unsigned int)(g->pass_iobps%1000000/10000),
+            (unsigned int)(speedup/100),
+            (unsigned int)(speedup%100));
+         // the new shards relearn their health reference
+         if (nworkers < g->workers)
+            nworkers++;
          else
-            write_rand(g, wbuf, g->block_size);
-         measurebw(1, 0, &g->buffer_bw);
-         write(fd, wbuf, g->block_size);
-         buffer_wrbps1 = measurebw(0, g->block_size, &g->buffer_bw);
-         g->written_total += g->block_size;
-
-         if(g->verbose) {
-            LOG("stats:%lu:%lu:wrbw=%u.%02u MB/s:rdbw=%u.%02u MB/s",
-               g->written_total,
-               g->pass_count,
-               (unsigned int)pass_wrbps/1000000,
-               (unsigned int)pass_wrbps%1000000,
-               (unsigned int)pass_rdbps/1000000,
-               (unsigned int)pass_rdbps%1000000);
-            LOG(":buffer stats:W1:%lu:%lu:%u.%02u MB/s\n",
-               g->buffer_bw.result_bytes,
-               g->buffer_bw.result_usecs,
-               (unsigned int)(buffer_wrbps1/1000000),
-               (unsigned int)(buffer_wrbps1%1000000));
-         }
-
-         // read ones and check:
-         lseek(fd, index*g->block_size, SEEK_SET);
-         measurebw(1, 0, &g->buffer_bw);
-         read(fd, rbuf, g->block_size);
-         buffer_rdbps1 = measurebw(0, g->block_size, &g->buffer_bw);
-
-         if (memcmp(rbuf,wbuf,g->block_size))
-         {
-            FILE *fd = fopen("wbuf","w+");
-            fwrite(wbuf,1,g->block_size,fd);
-            fclose(fd);
-            fd = fopen("rbuf","w+");
-            fwrite(rbuf,1,g->block_size,fd);
-            fclose(fd);
-
-            LOG("error at block %d, exiting...\n", index);
-            rc = -1;
-            goto done;
-         }
-         if(g->verbose) {
-            LOG("stats:%lu:%lu:wrbw=%u.%02u MB/s:rdbw=%u.%02u MB/s",
-               g->written_total,
-               g->pass_count,
-               (unsigned int)pass_wrbps/1000000,
-               (unsigned int)pass_wrbps%1000000,
-               (unsigned int)pass_rdbps/1000000,
-               (unsigned int)pass_rdbps%1000000);
-            LOG(":buffer stats:R1:%lu:%lu:%u.%02u MB/s\n",
-               g->buffer_bw.result_bytes,
-               g->buffer_bw.result_usecs,
-               (unsigned int)(buffer_rdbps1/1000000),
-               (unsigned int)(buffer_rdbps1%1000000));
-         }
-
-         // write zeroes or rand:
-         lseek(fd, index*g->block_size, SEEK_SET);
-         if (g->test_type == ZERO)
-            memset(wbuf, 0, g->block_size);
-         else
-            write_rand(g, wbuf, g->block_size);
-         measurebw(1, 0, &g->buffer_bw);
-         write(fd, wbuf, g->block_size);
-         buffer_wrbps2 = measurebw(0, g->block_size, &g->buffer_bw);
-         g->written_total += g->block_size;
-
-         if(g->verbose) {
-            LOG("stats:%lu:%lu:wrbw=%u.%02u MB/s:rdbw=%u.%02u MB/s",
-               g->written_total,
-               g->pass_count,
-               (unsigned int)pass_wrbps/1000000,
-               (unsigned int)pass_wrbps%1000000,
-               (unsigned int)pass_rdbps/1000000,
-               (unsigned int)pass_rdbps%1000000);
-            LOG(":buffer stats:W2:%lu:%lu:%u.%02u MB/s\n",
-               g->buffer_bw.result_bytes,
-               g->buffer_bw.result_usecs,
-               (unsigned int)(buffer_wrbps2/1000000),
-               (unsigned int)(buffer_wrbps2%1000000));
-         }
-
-         // read zeroes and check:
-         lseek(fd, index*g->block_size, SEEK_SET);
-         measurebw(1, 0, &g->buffer_bw);
-         read(fd, rbuf, g->block_size);
-         buffer_rdbps2 = measurebw(0, g->block_size, &g->buffer_bw);
-
-         if (memcmp(rbuf,wbuf,g->block_size))
-         {
-            LOG("error at block %d, exiting...\n", index);
-            rc = -1;
-            goto done;
-         }
-         if(g->verbose) {
-            LOG("stats:%lu:%lu:wrbw=%u.%02u MB/s:rdbw=%u.%02u MB/s",
-               g->written_total,
-               g->pass_count,
-               (unsigned int)pass_wrbps/1000000,
-               (unsigned int)pass_wrbps%1000000,
-               (unsigned int)pass_rdbps/1000000,
-               (unsigned int)pass_rdbps%1000000);
-            LOG(":buffer stats:R2:%lu:%lu:%u.%02u MB/s\n",
-               g->buffer_bw.result_bytes,
-               g->buffer_bw.result_usecs,
-               (unsigned int)(buffer_rdbps2/1000000),
-               (unsigned int)(buffer_rdbps2%1000000));
-         }
-         index++;
-      } /* end full pass */
-
-      pass_wrbps = (buffer_wrbps1 + buffer_wrbps2) / 2;
-      pass_rdbps = (buffer_rdbps1 + buffer_rdbps2) / 2;
-      g->pass_count++;
+            ramp = 0;
+      }
    } /* end while(1) */
 
 done:
-   free(wbuf);
-   free(rbuf);
-   close(fd);
+   for (i = 0; i < g->workers; i++)
+   {
+      w = &g->worker[i];
+      free(w->wbuf);
+      free(w->rbuf);
+      free(w->wr_health.ref);
+      free(w->wr_health.sum);
+      free(w->wr_health.count);
+      free(w->rd_health.ref);
+      free(w->rd_health.sum);
+      free(w->rd_health.count);
+      close(w->fd);
+   }
+   free(g->worker);
    return rc;
 }
 
@@ -595,13 +994,204 @@ static uint64_t measurebw(int start, uint64_t bytes, bwt_t *bwt)
    return 0;
 }
 
+/*!
+ * @brief Health Setup - map a tracker onto a shard and forget its reference
+ *
+ * Called whenever the shard changes, including each -s ramp step, since
+ * the per-block timings change with the number of workers.
+ *
+ * @param h             health stats for this operation
+ * @param first         first block of the shard
+ * @param blocks        blocks in the shard
+ */
+static void health_setup(health_t *h, unsigned int first, unsigned int blocks)
+{
+   h->first = first;
+   h->blocks = blocks;
+   h->regions = (blocks < DEGRADE_REGIONS) ? blocks : DEGRADE_REGIONS;
+   free(h->ref);
+   free(h->sum);
+   free(h->count);
+   // phase 1 and phase 2 timings are kept apart, hence 2x
+   h->ref = calloc(2 * h->regions, sizeof(float));
+   h->sum = calloc(2 * h->regions, sizeof(float));
+   h->count = calloc(2 * h->regions, sizeof(uint32_t));
+   if (!h->ref || !h->sum || !h->count)
+   {
+      LOG("could not allocate health stats, exiting\n");
+      exit(-1);
+   }
+   h->learned = 0;
+   h->cusum = 0;
+   h->shift = 0;
+}
+
+/*!
+ * @brief Health Pass - end of pass, freeze the reference and reset the trips
+ *
+ * @param h             health stats for this operation
+ */
+static void health_pass(health_t *h)
+{
+   unsigned int r;
+
+   if (!h->learned && h->ref)
+   {
+      for (r = 0; r < 2 * h->regions; r++)
+         if (h->count[r])
+            h->ref[r] = h->sum[r] / h->count[r];
+      h->learned = 1;
+   }
+   h->trips = 0;
+   h->pass_changes = 0;
+}
+
+/*!
+ * @brief Track block timings online and flag a degrading card
+ *
+ * The first full pass over a shard is the reference: the mean time of
+ * each region of the shard (a single block unless the shard has more
+ * than DEGRADE_REGIONS), kept apart for the phase 1 and phase 2 I/O.
+ * Later passes compare each block against its own region, as the log
+ * of the ratio with DEGRADE_NOISE_USECS added to both sides, so cards whose timing depends on position (SLC cache
+ * regions, slower zones) stay quiet as long as they repeat pass to pass.
+ * This assumes the first pass is a healthy card, and only catches
+ * slowdowns, not a card that gets faster.
+ *
+ * A block over DEGRADE_OUTLIER_FACTOR times its reference is a slow block
+ * outlier, over DEGRADE_STALL_FACTOR a stall. A one-sided CUSUM of the
+ * log ratio catches a sustained shift; only the CUSUM is reset when it
+ * fires, the reference is kept, so a lasting cliff keeps tripping it.
+ * Marking or stopping needs DEGRADE_TRIPS stalls or change points within
+ * one pass of one tracker, so rare GC stalls over a long run don't add up.
+ *
+ * @param g             pointer to globals
+ * @param h             health stats for this operation
+ * @param op            operation tag for alerts, "W1", "R2", ...
+ * @param index         block index
+ * @param usecs         time taken by the block
+ */
+static void health_update(globals_t *g, health_t *h, const char *op,
+                          unsigned int index, uint64_t usecs)
+{
+   double x = (double)usecs;
+   double alpha, d, y, ref;
+   unsigned int r;
+   int tripped = 0;
+
+   // EWMA of the raw timing, for the health line
+   h->samples++;
+   alpha = 1.0 / h->samples;
+   if (alpha < DEGRADE_ALPHA)
+      alpha = DEGRADE_ALPHA;
+   d = x - h->mean;
+   h->mean += alpha * d;
+   h->var = (1 - alpha) * (h->var + alpha * d * d);
+
+   // region of the shard, then phase 2 regions follow phase 1
+   r = (unsigned int)((uint64_t)(index - h->first) * h->regions / h->blocks);
+   if (op[1] == '2')
+      r += h->regions;
+
+   if (!h->learned)
+   {
+      h->sum[r] += x;
+      h->count[r]++;
+      return;
+   }
+
+   ref = h->ref[r];
+   if (ref <= 0)
+      return;
+   y = log((x + DEGRADE_NOISE_USECS) / (ref + DEGRADE_NOISE_USECS));
+   h->shift += DEGRADE_ALPHA * (y - h->shift);
+
+   if (y > log(DEGRADE_STALL_FACTOR))
+   {
+      // a stall is its own trip, keep it out of the CUSUM
+      h->stalls++;
+      h->trips++;
+      tripped = 1;
+      LOG("alert:%s:block %u:stall %lu usecs, reference %lu usecs\n",
+         op, index, usecs, (uint64_t)ref);
+   }
+   else
+   {
+      if (y > log(DEGRADE_OUTLIER_FACTOR))
+      {
+         h->outliers++;
+         LOG("alert:%s:block %u:slow block %lu usecs, reference %lu usecs\n",
+            op, index, usecs, (uint64_t)ref);
+      }
+      h->cusum += y - DEGRADE_CUSUM_K;
+      if (h->cusum < 0)
+         h->cusum = 0;
+      if (h->cusum > DEGRADE_CUSUM_H)
+      {
+         h->changes++;
+         h->trips++;
+         tripped = 1;
+         h->cusum = 0;
+         // once per pass, a lasting cliff fires every few blocks
+         if (!h->pass_changes++)
+            LOG("alert:%s:block %u:bandwidth change, %u%% slower than reference\n",
+               op, index, (unsigned int)((exp(h->shift) - 1) * 100));
+      }
+   }
+
+   if (!tripped || h->trips < DEGRADE_TRIPS)
+      return;
+   if (g->degrade_policy >= DEGRADE_MARK)
+      g->degraded = 1;
+   if (g->degrade_policy >= DEGRADE_STOP && !g->halt)
+   {
+      LOG("card degraded at block %u, stopping...\n", index);
+      g->halt = 1;
+   }
+}
+
+/*!
+ * @brief Log the health stats, done each pass ahead of the stats line
+ *
+ */
+static void health_log(globals_t *g)
+{
+   health_t *h[2];
+   const char *op[2] = { "W", "R" };
+   char tag[16];
+   unsigned int i, j;
+
+   // only workers used by the last pass, -s ramps up from one
+   for (j = 0; j < g->active; j++)
+   {
+      h[0] = &g->worker[j].wr_health;
+      h[1] = &g->worker[j].rd_health;
+      for (i = 0; i < 2; i++)
+      {
+         // tag with the shard number only when there is more than one
+         if (g->workers > 1)
+            sprintf(tag, "%s%u", op[i], j);
+         else
+            strcpy(tag, op[i]);
+         LOG("health:%s:mean=%lu us:sd=%lu us:shift=%d%%:outliers=%lu:stalls=%lu:changes=%lu\n",
+            tag,
+            (uint64_t)h[i]->mean,
+            (uint64_t)sqrt(h[i]->var),
+            (int)((exp(h[i]->shift) - 1) * 100),
+            h[i]->outliers,
+            h[i]->stalls,
+            h[i]->changes);
+      }
+   }
+}
+
 /*!
  * @brief Log Utility
  *
  */
 static void sdlog(const char* format, ... )
 {
-   char sdmsg[120];
+   char sdmsg[256];
    va_list args;
    va_start( args, format );
 
@@ -609,7 +1199,7 @@ static void sdlog(const char* format, ... )
    if (G->timestamp)
       sprintf(&sdmsg[strlen(sdmsg)],"[%s]", gettime());
    strcat(sdmsg, " ");
-   vsprintf(&sdmsg[strlen(sdmsg)], format, args );
+   vsnprintf(&sdmsg[strlen(sdmsg)], sizeof(sdmsg)-strlen(sdmsg), format, args );
    if (G->logstdout || !G->logfd)
       printf("%s",sdmsg);fflush(stdout);
    if (G->logfd)
@@ -662,13 +1252,14 @@ static void check_device_name(globals_t *g)
  */
 static char *gettime()
 {
-   // do as I say, not as I do...
+   // do as I say, not as I do... per thread buffer, workers log too
+   static __thread char tstr[32];
    time_t t;
    char delim[] = "\n";
-   char *tstr;
+   char *s1;
    time(&t);
-   tstr = ctime(&t);
-   return strtok(tstr, delim);
+   ctime_r(&t, tstr);
+   return strtok_r(tstr, delim, &s1);
 }
 
 static uint32_t crc32_tab[] = {